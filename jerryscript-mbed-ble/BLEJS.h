@@ -17,14 +17,34 @@
 
 #include "jerryscript-mbed-event-loop/EventLoop.h"
 #include "jerryscript-mbed-ble/ble-js.h"
+#include "jerryscript-mbed-ble/blejs_types.h"
+#include "jerryscript-mbed-ble/BLEJSStore.h"
 
+#include <algorithm>
 #include <map>
+#include <vector>
+#include <sys/stat.h>
 
 #include "Callback.h"
+#include "Ticker.h"
+#include "Timeout.h"
+#include "Timer.h"
 #include "ble/BLE.h"
 
 using namespace std;
 
+// maximum number of CCCD subscriptions remembered per bonded peer
+#define BLEJS_MAX_STORED_SUBSCRIPTIONS 16
+
+// per peer: database hash, then (value handle, CCCD value, service hash)
+// entries, all little endian
+#define BLEJS_SUBSCRIPTION_RECORD_SIZE (4 + 8 * BLEJS_MAX_STORED_SUBSCRIPTIONS)
+
+// stack specific hook to indicate Service Changed for [start, end] to a peer
+typedef void (*service_changed_handler_t)(Gap::Handle_t connection,
+                                          GattAttribute::Handle_t start,
+                                          GattAttribute::Handle_t end);
+
 typedef struct {
     uint8_t *buffer;
     size_t buffer_length;
@@ -53,7 +73,50 @@ static uint16_t hex_str_to_u16(const char* buf, const size_t buf_size) {
     return ans;
 }
 
-class BLEJS {
+// copy a JS array of byte values into buffer; returns false (and copies
+// nothing) if the array does not fit.
+static bool js_array_to_buffer(jerry_value_t array, uint8_t* buffer, size_t buffer_size, size_t* out_length) {
+    size_t length = jerry_get_array_length(array);
+    if (length > buffer_size) {
+        return false;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        jerry_value_t val = jerry_get_property_by_index(array, i);
+        buffer[i] = uint8_t(jerry_get_number_value(val));
+        jerry_release_value(val);
+    }
+
+    *out_length = length;
+    return true;
+}
+
+static uint32_t read_u32(const uint8_t* buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static void write_u32(uint8_t* buf, uint32_t value) {
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+    buf[2] = (value >> 16) & 0xff;
+    buf[3] = (value >> 24) & 0xff;
+}
+
+static uint32_t fnv1a(uint32_t hash, const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+class BLEJS
+#if BLE_ROLE_PERIPHERAL
+    // the newer BLE API reports connection parameter updates through this
+    : public ble::Gap::EventHandler
+#endif
+{
  public:
     static BLEJS& Instance() {
         static BLEJS instance(BLE::Instance());
@@ -143,20 +206,276 @@ class BLEJS {
         ble.stopAdvertising();
     }
 
-    void addService(GattService *srvc) {
-        ble.addService(*srvc);
+#if BLE_FEATURE_EXTENDED_ADVERTISING
+    bool createAdvertisingSet(uint32_t adv_interval, bool connectable, ble::advertising_handle_t* handle) {
+        ble::AdvertisingParameters params(
+            connectable ? ble::advertising_type_t::CONNECTABLE_NON_SCANNABLE_UNDIRECTED
+                        : ble::advertising_type_t::NON_CONNECTABLE_UNDIRECTED,
+            ble::adv_interval_t(ble::millisecond_t(adv_interval)),
+            ble::adv_interval_t(ble::millisecond_t(adv_interval)),
+            false /* extended PDUs */
+        );
+
+        ble_error_t err = ble.gap().createAdvertisingSet(handle, params);
+        if (err != BLE_ERROR_NONE) {
+            LOG_PRINT_ALWAYS("Error while creating advertising set (%s, max %u sets)\r\n",
+                             BLE::errorToString(err), ble.gap().getMaxAdvertisingSetNumber());
+            return false;
+        }
+
+        // connectable sets are limited to what fits in a single PDU
+        size_t max_length = connectable ? ble.gap().getMaxConnectableAdvertisingDataLength()
+                                        : ble.gap().getMaxAdvertisingDataLength();
+
+        js_ble_adv_set_data_t* set = (js_ble_adv_set_data_t*)calloc(1, sizeof(js_ble_adv_set_data_t));
+        set->payload = (uint8_t*)calloc(max_length, 1);
+        set->max_length = max_length;
+        set->connectable = connectable;
+
+        adv_sets[*handle] = set;
+        return true;
+    }
+
+    void setAdvertisingPayload(ble::advertising_handle_t handle, jerry_value_t payload_js) {
+        js_ble_adv_set_data_t* set = getAdvertisingSet(handle);
+        if (!set) {
+            return;
+        }
+
+        // the controller only takes smaller updates while the set is running;
+        // ask the stack, as sets also stop on their own (connection, timeout)
+        bool active = ble.gap().isAdvertisingActive(handle);
+        size_t limit = getPayloadLimit(set, active);
+        if (!js_array_to_buffer(payload_js, set->payload, limit, &set->payload_length)) {
+            LOG_PRINT_ALWAYS("advertising payload exceeds %u bytes%s. Ignoring.\r\n", (unsigned)limit,
+                             active ? " while advertising" : "");
+            return;
+        }
+
+        // the controller takes the new data while the set keeps running
+        ble_error_t err = ble.gap().setAdvertisingPayload(handle, mbed::make_const_Span(set->payload, set->payload_length));
+        if (err != BLE_ERROR_NONE) {
+            LOG_PRINT_ALWAYS("Error while setting advertising payload (%s)\r\n", BLE::errorToString(err));
+        }
+    }
+
+    bool startAdvertisingSet(ble::advertising_handle_t handle) {
+        js_ble_adv_set_data_t* set = getAdvertisingSet(handle);
+        if (!set) {
+            return false;
+        }
+
+        ble_error_t err = ble.gap().setAdvertisingPayload(handle, mbed::make_const_Span(set->payload, set->payload_length));
+        if (err == BLE_ERROR_NONE) {
+            err = ble.gap().startAdvertising(handle);
+        }
+
+        if (err != BLE_ERROR_NONE) {
+            LOG_PRINT_ALWAYS("Error while starting advertising set (%s)\r\n", BLE::errorToString(err));
+            return false;
+        }
+
+        return true;
+    }
+
+    void stopAdvertisingSet(ble::advertising_handle_t handle) {
+        js_ble_adv_set_data_t* set = getAdvertisingSet(handle);
+        if (!set) {
+            return;
+        }
+
+#if BLE_FEATURE_PERIODIC_ADVERTISING
+        stopPeriodicAdvertising(handle);
+#endif
+        ble.gap().stopAdvertising(handle);
+    }
+
+    void destroyAdvertisingSet(ble::advertising_handle_t handle) {
+        js_ble_adv_set_data_t* set = getAdvertisingSet(handle);
+        if (!set) {
+            return;
+        }
+
+        stopAdvertisingSet(handle);
+        ble.gap().destroyAdvertisingSet(handle);
+
+        adv_sets.erase(handle);
+        free(set->periodic_payload);
+        free(set->payload);
+        free(set);
+    }
+
+#if BLE_FEATURE_PERIODIC_ADVERTISING
+    void startPeriodicAdvertising(ble::advertising_handle_t handle, uint32_t periodic_interval) {
+        js_ble_adv_set_data_t* set = getAdvertisingSet(handle);
+        if (!set) {
+            return;
+        }
+
+        if (set->connectable) {
+            LOG_PRINT_ALWAYS("periodic advertising requires a non-connectable set. Ignoring.\r\n");
+            return;
+        }
+
+        if (!set->periodic_payload) {
+            set->periodic_payload = (uint8_t*)calloc(set->max_length, 1);
+        }
+
+        ble_error_t err = ble.gap().setPeriodicAdvertisingParameters(handle,
+            ble::periodic_interval_t(ble::millisecond_t(periodic_interval)),
+            ble::periodic_interval_t(ble::millisecond_t(periodic_interval)));
+        if (err == BLE_ERROR_NONE) {
+            err = ble.gap().setPeriodicAdvertisingPayload(handle,
+                mbed::make_const_Span(set->periodic_payload, set->periodic_payload_length));
+        }
+
+        if (err != BLE_ERROR_NONE) {
+            LOG_PRINT_ALWAYS("Error while configuring periodic advertising (%s)\r\n", BLE::errorToString(err));
+            return;
+        }
+
+        // periodic advertising is only emitted alongside the extended set
+        if (!ble.gap().isAdvertisingActive(handle) && !startAdvertisingSet(handle)) {
+            return;
+        }
+
+        err = ble.gap().startPeriodicAdvertising(handle);
+        if (err != BLE_ERROR_NONE) {
+            LOG_PRINT_ALWAYS("Error while starting periodic advertising (%s)\r\n", BLE::errorToString(err));
+        }
+    }
+
+    void setPeriodicAdvertisingPayload(ble::advertising_handle_t handle, jerry_value_t payload_js) {
+        js_ble_adv_set_data_t* set = getAdvertisingSet(handle);
+        if (!set) {
+            return;
+        }
+
+        if (!set->periodic_payload) {
+            set->periodic_payload = (uint8_t*)calloc(set->max_length, 1);
+        }
+
+        bool active = ble.gap().isPeriodicAdvertisingActive(handle);
+        size_t limit = getPayloadLimit(set, active);
+        if (!js_array_to_buffer(payload_js, set->periodic_payload, limit, &set->periodic_payload_length)) {
+            LOG_PRINT_ALWAYS("periodic advertising payload exceeds %u bytes%s. Ignoring.\r\n", (unsigned)limit,
+                             active ? " while advertising" : "");
+            return;
+        }
+
+        // if the train is not running yet, the buffer is applied by startPeriodicAdvertising
+        if (active) {
+            ble_error_t err = ble.gap().setPeriodicAdvertisingPayload(handle,
+                mbed::make_const_Span(set->periodic_payload, set->periodic_payload_length));
+            if (err != BLE_ERROR_NONE) {
+                LOG_PRINT_ALWAYS("Error while setting periodic advertising payload (%s)\r\n", BLE::errorToString(err));
+            }
+        }
+    }
+
+    void stopPeriodicAdvertising(ble::advertising_handle_t handle) {
+        js_ble_adv_set_data_t* set = getAdvertisingSet(handle);
+        if (!set || !ble.gap().isPeriodicAdvertisingActive(handle)) {
+            return;
+        }
+
+        ble.gap().stopPeriodicAdvertising(handle);
+    }
+#endif // BLE_FEATURE_PERIODIC_ADVERTISING
+#endif // BLE_FEATURE_EXTENDED_ADVERTISING
+
+    void addService(jerry_value_t service_obj, GattService *srvc) {
+        if (find(services.begin(), services.end(), srvc) != services.end()) {
+            LOG_PRINT_ALWAYS("service was already added. Ignoring.\r\n");
+            return;
+        }
+
+        if (ble.addService(*srvc) != BLE_ERROR_NONE) {
+            LOG_PRINT_ALWAYS("Error while adding service\r\n");
+            return;
+        }
+        services.push_back(srvc);
+
+        // the JS object owns the GattService, keep it alive while registered
+        service_objects[srvc] = jerry_acquire_value(service_obj);
+        rebuildHandleMap();
+
+        // new services are appended after everything else
+        serviceChanged(srvc->getHandle(), 0xFFFF);
+    }
+
+    /**
+     * The BLE API cannot indicate Service Changed, so ports register the
+     * stack specific call here. None is registered by default: without
+     * one, connected peers only see the new database after rediscovering
+     * it themselves.
+     */
+    void setServiceChangedHandler(service_changed_handler_t handler) {
+        service_changed_handler = handler;
     }
 
     void onConnection(jerry_value_t f) {
         connect_cb_function = f;
-        ble.gap().onConnection(this, &BLEJS::connectionCallback);
     }
 
     void onDisconnection(jerry_value_t f) {
         disconnect_cb_function = f;
-        ble.gap().onDisconnection(this, &BLEJS::disconnectionCallback);
     }
 
+    /**
+     * Replace the store used for per-peer state. Must be called before
+     * enableBonding(), otherwise a BLEJSFileStore is used.
+     */
+    void setStore(BLEJSStore* s) {
+        store = s;
+    }
+
+#if BLE_FEATURE_SECURITY
+    void enableBonding(jerry_value_t path_js) {
+        char path[64] = {0};
+        jerry_size_t path_size = jerry_get_string_size(path_js);
+        if (path_size == 0 || path_size >= sizeof(path)) {
+            LOG_PRINT_ALWAYS("bonding path must be 1 to %u bytes long. Ignoring.\r\n", (unsigned)(sizeof(path) - 1));
+            return;
+        }
+        jerry_string_to_char_buffer(path_js, (jerry_char_t*)path, path_size);
+
+        // the stack's security database lives here even with a custom store;
+        // fails harmlessly if the directory is already there
+        mkdir(path, 0777);
+
+        if (!store) {
+            store = new BLEJSFileStore(path);
+        }
+
+        // bonding keys live in the stack's own security database, next to our state
+        char db_path[96];
+        snprintf(db_path, sizeof(db_path), "%s/bonds", path);
+
+        if (ble.securityManager().init(true, false, SecurityManager::IO_CAPS_NONE, NULL, false, db_path) != BLE_ERROR_NONE) {
+            LOG_PRINT_ALWAYS("Error while initialising the security manager\r\n");
+            return;
+        }
+
+        ble.securityManager().preserveBondingStateOnReset(true);
+        ble.securityManager().onLinkSecured(&BLEJS::linkSecuredCallback);
+        ble.securityManager().onSecuritySetupCompleted(&BLEJS::securitySetupCompletedCallback);
+
+#if BLE_FEATURE_PRIVACY
+        // with privacy on, bonded peers using resolvable private addresses
+        // are reported with their identity address, which state is keyed on.
+        // Peers that cannot be resolved are accepted without pairing.
+        ble::peripheral_privacy_configuration_t privacy = {
+            false, ble::peripheral_privacy_configuration_t::DO_NOT_RESOLVE
+        };
+        ble.gap().setPeripheralPrivacyConfiguration(&privacy);
+        ble.gap().enablePrivacy(true);
+#endif
+
+        bonding_enabled = true;
+    }
+#endif // BLE_FEATURE_SECURITY
+
     bool isConnected() {
         return ble.gap().getState().connected;
     }
@@ -166,14 +485,94 @@ class BLEJS {
     }
 
     void clearWriteCallback(GattCharacteristic* characteristic) {
-        write_callbacks.erase(characteristic);
+        map<GattCharacteristic*, jerry_value_t>::iterator it = write_callbacks.find(characteristic);
+        if (it == write_callbacks.end()) {
+            return;
+        }
+
+        jerry_release_value(it->second);
+        write_callbacks.erase(it);
+    }
+
+    /**
+     * Call f lead_ms before every connection event; the array it returns is
+     * written to the characteristic (and so notified) in that event. If it
+     * returns anything else, or has not run by the next event, the last
+     * value is queued again once that event has started.
+     */
+    void setProducer(GattCharacteristic* characteristic, uint32_t lead_ms, jerry_value_t f) {
+        clearProducer(characteristic);
+
+        js_ble_producer_t* producer = (js_ble_producer_t*)calloc(1, sizeof(js_ble_producer_t));
+        producer->callback = f;
+        producer->lead_us = lead_ms * 1000;
+
+        producers[characteristic] = producer;
+
+        // all producers share one timer, so fire early enough for the largest lead
+        if (producer->lead_us > producer_lead_us) {
+            producer_lead_us = producer->lead_us;
+        }
+
+        initRadioNotification();
+
+        if (isConnected()) {
+            startProducers();
+        }
+    }
+
+    void clearProducer(GattCharacteristic* characteristic) {
+        map<GattCharacteristic*, js_ble_producer_t*>::iterator it = producers.find(characteristic);
+        if (it == producers.end()) {
+            return;
+        }
+
+        jerry_release_value(it->second->callback);
+
+        free(it->second);
+        producers.erase(it);
+
+        producer_lead_us = 0;
+        for (it = producers.begin(); it != producers.end(); it++) {
+            if (it->second->lead_us > producer_lead_us) {
+                producer_lead_us = it->second->lead_us;
+            }
+        }
+
+        if (producers.empty()) {
+            stopProducers();
+        }
     }
 
  private:
      BLEJS(BLE &ble) : ble(ble) {
         this_obj = jerry_create_null();
+        connect_cb_function = jerry_create_undefined();
+        disconnect_cb_function = jerry_create_undefined();
 
+        store = NULL;
+        bonding_enabled = false;
+        peer_secured = false;
+        peer_key[0] = '\0';
+
+        connection_interval_us = 0;
+        producer_lead_us = 0;
+        radio_notification_init = false;
+        radio_notification = false;
+        connection_event_count = 0;
+        producer_target_event = 0;
+
+        connection_handle = 0;
+        service_changed_handler = NULL;
+
+        ble.gap().onConnection(this, &BLEJS::connectionCallback);
+        ble.gap().onDisconnection(this, &BLEJS::disconnectionCallback);
         ble.gattServer().onDataWritten(this, &BLEJS::onDataWrittenCallback);
+        ble.gattServer().onUpdatesEnabled(GattServer::EventCallback_t(this, &BLEJS::updatesEnabledCallback));
+        ble.gattServer().onUpdatesDisabled(GattServer::EventCallback_t(this, &BLEJS::updatesDisabledCallback));
+#if BLE_ROLE_PERIPHERAL
+        ble.gap().setEventHandler(this);
+#endif
     }
 
     ~BLEJS() {
@@ -188,42 +587,490 @@ class BLEJS {
             return;
         }
 
+        // producers may have been registered before the stack was up
+        initRadioNotification();
+
         if (jerry_value_is_function(init_cb_function)) {
             jerry_call_function(init_cb_function, this_obj, NULL, 0);
         }
     }
 
+    void rebuildHandleMap() {
+        characteristic_handles.clear();
+
+        for (size_t i = 0; i < services.size(); i++) {
+            for (uint8_t j = 0; j < services[i]->getCharacteristicCount(); j++) {
+                GattCharacteristic* characteristic = services[i]->getCharacteristic(j);
+                characteristic_handles[characteristic->getValueHandle()] = characteristic;
+            }
+        }
+    }
+
+    void serviceChanged(GattAttribute::Handle_t start, GattAttribute::Handle_t end) {
+        if (!isConnected()) {
+            return;
+        }
+
+        if (service_changed_handler) {
+            service_changed_handler(connection_handle, start, end);
+        } else {
+            LOG_PRINT_ALWAYS("GATT database changed, peer has to rediscover\r\n");
+        }
+    }
+
     void scheduleBleEvents(BLE::OnEventsToProcessCallbackContext* context) {
         BLE &ble = BLE::Instance();
         mbed::js::EventLoop::getInstance().nativeCallback(mbed::Callback<void()>(&ble, &BLE::processEvents));
     }
 
     void connectionCallback(const Gap::ConnectionCallbackParams_t *params) {
+        connection_handle = params->handle;
+        peer_secured = false;
+        subscriptions.clear();
+
+        // interval is in units of 1.25ms
+        connection_interval_us = params->connectionParams->maxConnectionInterval * 1250;
+        if (!producers.empty()) {
+            startProducers();
+        }
+
+#if BLE_FEATURE_SECURITY
+        setPeerKey(params->peerAddressType, params->peerAddr);
+
+        // ask a returning peer to re-encrypt right away, its subscriptions
+        // are restored as soon as the link is secured. New peers are not
+        // asked to pair, they bond when they start pairing themselves.
+        if (bonding_enabled && isKnownPeer()) {
+            ble.securityManager().setLinkSecurity(params->handle, SecurityManager::SECURITY_MODE_ENCRYPTION_NO_MITM);
+        }
+#endif
+
         if (jerry_value_is_function(connect_cb_function)) {
             jerry_call_function(connect_cb_function, this_obj, NULL, 0);
         }
     }
 
     void disconnectionCallback(const Gap::DisconnectionCallbackParams_t *params) {
+        peer_secured = false;
+        peer_key[0] = '\0';
+        subscriptions.clear();
+        stopProducers();
+
         if (jerry_value_is_function(disconnect_cb_function)) {
             jerry_call_function(disconnect_cb_function, this_obj, NULL, 0);
         }
     }
 
-    void onDataWrittenCallback(const GattWriteCallbackParams *params) {
-        // see if we know for which char this message is...
-        typedef std::map<GattCharacteristic*, jerry_value_t>::iterator it_type;
-        for(it_type it = write_callbacks.begin(); it != write_callbacks.end(); it++) {
-            if (it->first->getValueHandle() == params->handle) {
-                if (jerry_value_is_function(it->second)) {
-                    const jerry_value_t args[1] = {
-                        getJsValueFromCharacteristic(it->first)
-                    };
-
-                    // @todo, this_obj is wrong
-                    jerry_call_function(it->second, this_obj, args, 1);
+#if BLE_FEATURE_EXTENDED_ADVERTISING
+    js_ble_adv_set_data_t* getAdvertisingSet(ble::advertising_handle_t handle) {
+        map<ble::advertising_handle_t, js_ble_adv_set_data_t*>::iterator it = adv_sets.find(handle);
+        if (it == adv_sets.end()) {
+            LOG_PRINT_ALWAYS("unknown advertising set (%u). Ignoring.\r\n", handle);
+            return NULL;
+        }
+
+        return it->second;
+    }
+
+    size_t getPayloadLimit(js_ble_adv_set_data_t* set, bool active) {
+        size_t active_limit = ble.gap().getMaxActiveSetAdvertisingDataLength();
+
+        if (active && active_limit < set->max_length) {
+            return active_limit;
+        }
+
+        return set->max_length;
+    }
+#endif
+
+#if BLE_FEATURE_SECURITY
+    static void linkSecuredCallback(Gap::Handle_t handle, SecurityManager::SecurityMode_t securityMode) {
+        BLEJS::Instance().restoreSubscriptions(handle);
+    }
+
+    static void securitySetupCompletedCallback(Gap::Handle_t handle, SecurityManager::SecurityCompletionStatus_t status) {
+        if (status != SecurityManager::SEC_STATUS_SUCCESS) {
+            BLEJS::Instance().forgetPeer();
+        }
+    }
+
+    // the peer could not secure the link with us (e.g. it deleted the bond),
+    // so stop treating it as known
+    void forgetPeer() {
+        if (store && peer_key[0]) {
+            LOG_PRINT_ALWAYS("link could not be secured, dropping stored state\r\n");
+            store->remove(peer_key);
+        }
+    }
+#endif
+
+    GattCharacteristic* findCharacteristic(GattAttribute::Handle_t handle) {
+        map<GattAttribute::Handle_t, GattCharacteristic*>::iterator it = characteristic_handles.find(handle);
+
+        // stacks report either the value handle or the CCCD handle,
+        // which is registered directly after the value
+        if (it == characteristic_handles.end()) {
+            it = characteristic_handles.find(handle - 1);
+        }
+
+        if (it == characteristic_handles.end()) {
+            return NULL;
+        }
+
+        return it->second;
+    }
+
+    /**
+     * Hash over the attributes of a service that a peer caches (UUIDs,
+     * properties and handles), used to tell whether stored subscriptions
+     * to it are still valid.
+     */
+    uint32_t serviceHash(GattService* service) {
+        uint32_t hash = 2166136261u;
+
+        const UUID& service_uuid = service->getUUID();
+        GattAttribute::Handle_t service_handle = service->getHandle();
+        hash = fnv1a(hash, service_uuid.getBaseUUID(), service_uuid.getLen());
+        hash = fnv1a(hash, (const uint8_t*)&service_handle, sizeof(service_handle));
+
+        for (uint8_t j = 0; j < service->getCharacteristicCount(); j++) {
+            GattCharacteristic* characteristic = service->getCharacteristic(j);
+            const UUID& char_uuid = characteristic->getValueAttribute().getUUID();
+            uint8_t props = characteristic->getProperties();
+            GattAttribute::Handle_t value_handle = characteristic->getValueHandle();
+
+            hash = fnv1a(hash, char_uuid.getBaseUUID(), char_uuid.getLen());
+            hash = fnv1a(hash, &props, sizeof(props));
+            hash = fnv1a(hash, (const uint8_t*)&value_handle, sizeof(value_handle));
+        }
+
+        return hash;
+    }
+
+    // tells whether the peer's cached copy of the whole database is stale
+    uint32_t databaseHash() {
+        uint32_t hash = 2166136261u;
+
+        for (size_t i = 0; i < services.size(); i++) {
+            uint32_t service_hash = serviceHash(services[i]);
+            hash = fnv1a(hash, (const uint8_t*)&service_hash, sizeof(service_hash));
+        }
+
+        return hash;
+    }
+
+    GattService* findService(GattCharacteristic* characteristic) {
+        for (size_t i = 0; i < services.size(); i++) {
+            for (uint8_t j = 0; j < services[i]->getCharacteristicCount(); j++) {
+                if (services[i]->getCharacteristic(j) == characteristic) {
+                    return services[i];
+                }
+            }
+        }
+
+        return NULL;
+    }
+
+#if BLE_FEATURE_SECURITY
+    /**
+     * Per-peer state is keyed on the identity address. Private addresses
+     * that were not resolved change over time, so no key is set for them.
+     */
+    void setPeerKey(ble::peer_address_type_t type, const BLEProtocol::AddressBytes_t address) {
+        char prefix;
+
+        if (type == ble::peer_address_type_t::PUBLIC || type == ble::peer_address_type_t::PUBLIC_IDENTITY) {
+            prefix = 'p';
+        } else if (type == ble::peer_address_type_t::RANDOM_STATIC_IDENTITY ||
+                   (type == ble::peer_address_type_t::RANDOM && (address[5] & 0xC0) == 0xC0)) {
+            prefix = 'r';
+        } else {
+            peer_key[0] = '\0';
+            return;
+        }
+
+        snprintf(peer_key, sizeof(peer_key), "%c%02x%02x%02x%02x%02x%02x", prefix,
+                 address[5], address[4], address[3], address[2], address[1], address[0]);
+    }
+
+    bool isKnownPeer() {
+        uint8_t hash[4];
+        return store && peer_key[0] && store->get(peer_key, hash, sizeof(hash)) >= 0;
+    }
+
+    void restoreSubscriptions(Gap::Handle_t handle) {
+        peer_secured = true;
+
+        if (!store || !peer_key[0]) {
+            return;
+        }
+
+        uint8_t record[BLEJS_SUBSCRIPTION_RECORD_SIZE];
+        int length = store->get(peer_key, record, sizeof(record));
+
+        if (length >= 4) {
+            // subscriptions survive as long as their own service is unchanged
+            for (int i = 4; i + 8 <= length; i += 8) {
+                GattAttribute::Handle_t value_handle = record[i] | (record[i + 1] << 8);
+                uint16_t cccd = record[i + 2] | (record[i + 3] << 8);
+                uint32_t service_hash = read_u32(&record[i + 4]);
+
+                map<GattAttribute::Handle_t, GattCharacteristic*>::iterator it = characteristic_handles.find(value_handle);
+                if (it == characteristic_handles.end()) {
+                    continue;
                 }
+
+                GattService* service = findService(it->second);
+                if (!service || serviceHash(service) != service_hash) {
+                    continue;
+                }
+
+                ble.gattServer().write(handle, value_handle + 1, &record[i + 2], 2, false);
+                subscriptions[value_handle] = cccd;
             }
+
+            // a peer that caches the database will not rediscover on its own
+            if (read_u32(record) != databaseHash()) {
+                serviceChanged(0x0001, 0xFFFF);
+            }
+        }
+
+        // also persists anything the peer subscribed to before the link was secured
+        saveSubscriptions();
+    }
+#endif // BLE_FEATURE_SECURITY
+
+    void saveSubscriptions() {
+        if (!store || !peer_secured || !peer_key[0]) {
+            return;
+        }
+
+        uint8_t record[BLEJS_SUBSCRIPTION_RECORD_SIZE];
+        write_u32(record, databaseHash());
+
+        size_t length = 4;
+        typedef map<GattAttribute::Handle_t, uint16_t>::iterator it_type;
+        for (it_type it = subscriptions.begin(); it != subscriptions.end() && length < sizeof(record); it++) {
+            map<GattAttribute::Handle_t, GattCharacteristic*>::iterator char_it = characteristic_handles.find(it->first);
+            GattService* service = (char_it != characteristic_handles.end()) ? findService(char_it->second) : NULL;
+            if (!service) {
+                continue;
+            }
+
+            record[length++] = it->first & 0xff;
+            record[length++] = it->first >> 8;
+            record[length++] = it->second & 0xff;
+            record[length++] = it->second >> 8;
+            write_u32(&record[length], serviceHash(service));
+            length += 4;
+        }
+
+        store->set(peer_key, record, length);
+    }
+
+    void updatesEnabledCallback(GattAttribute::Handle_t handle) {
+        GattCharacteristic* characteristic = findCharacteristic(handle);
+        if (!characteristic) {
+            return;
+        }
+
+        GattAttribute::Handle_t value_handle = characteristic->getValueHandle();
+
+        // the event does not say which bit was set, so read the peer's CCCD back
+        uint8_t cccd_buf[2];
+        uint16_t cccd_length = sizeof(cccd_buf);
+        uint16_t cccd;
+        if (ble.gattServer().read(connection_handle, value_handle + 1, cccd_buf, &cccd_length) == BLE_ERROR_NONE &&
+            cccd_length == sizeof(cccd_buf)) {
+            cccd = cccd_buf[0] | (cccd_buf[1] << 8);
+        } else {
+            // stack cannot read CCCDs per connection, prefer notifications
+            cccd = (characteristic->getProperties() & GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY)
+                       ? 0x0001 : 0x0002;
+        }
+
+        subscriptions[value_handle] = cccd;
+        saveSubscriptions();
+    }
+
+    void updatesDisabledCallback(GattAttribute::Handle_t handle) {
+        GattCharacteristic* characteristic = findCharacteristic(handle);
+        if (!characteristic) {
+            return;
+        }
+
+        subscriptions.erase(characteristic->getValueHandle());
+        saveSubscriptions();
+    }
+
+    void startProducers() {
+        event_timer.reset();
+        event_timer.start();
+
+        // without radio notifications there is nothing to align to, so fall
+        // back to a free running ticker at the connection interval
+        if (!radio_notification && connection_interval_us) {
+            connection_event_ticker.attach_us(mbed::Callback<void()>(this, &BLEJS::connectionEventIrq),
+                                              connection_interval_us);
+        }
+    }
+
+    void stopProducers() {
+        connection_event_ticker.detach();
+        producer_timeout.detach();
+        event_timer.stop();
+    }
+
+    // radio notifications need an initialised stack, so this is retried from initComplete
+    void initRadioNotification() {
+        if (radio_notification_init || producers.empty() || !ble.hasInitialized()) {
+            return;
+        }
+
+        radio_notification_init = true;
+        radio_notification = (ble.gap().initRadioNotification() == BLE_ERROR_NONE);
+        if (radio_notification) {
+            ble.gap().onRadioNotification(this, &BLEJS::radioNotificationCallback);
+        }
+    }
+
+    void radioNotificationCallback(bool radio_active) {
+        if (!radio_active || !isConnected() || producers.empty()) {
+            return;
+        }
+
+        // the radio also becomes active for advertising; connection events
+        // are one interval apart, so ignore activity in between
+        if ((uint32_t)event_timer.read_us() < connection_interval_us * 3 / 4) {
+            return;
+        }
+        event_timer.reset();
+
+        connectionEventIrq();
+    }
+
+    void connectionEventIrq() {
+        connectionEvent();
+
+        // the stack is not reentrant, so it is only called from the event loop
+        mbed::js::EventLoop::getInstance().nativeCallback(mbed::Callback<void()>(this, &BLEJS::repeatStaleValues));
+    }
+
+    void connectionEvent() {
+        connection_event_count++;
+
+        // the next event is one interval away
+        uint32_t delay_us = 0;
+        if (connection_interval_us > producer_lead_us) {
+            delay_us = connection_interval_us - producer_lead_us;
+        }
+        producer_timeout.attach_us(mbed::Callback<void()>(this, &BLEJS::producerIrq), delay_us);
+    }
+
+    void producerIrq() {
+        producer_target_event = connection_event_count + 1;
+        mbed::js::EventLoop::getInstance().nativeCallback(mbed::Callback<void()>(this, &BLEJS::runProducers));
+    }
+
+    void runProducers() {
+        // callbacks (or the GC finalising a characteristic) can clear
+        // producers, so walk a copy and look each one up again after use
+        vector<GattCharacteristic*> characteristics;
+        typedef map<GattCharacteristic*, js_ble_producer_t*>::iterator it_type;
+        for (it_type it = producers.begin(); it != producers.end(); it++) {
+            characteristics.push_back(it->first);
+        }
+
+        for (size_t i = 0; i < characteristics.size(); i++) {
+            it_type it = producers.find(characteristics[i]);
+            if (it == producers.end() || !jerry_value_is_function(it->second->callback)) {
+                continue;
+            }
+
+            jerry_value_t callback = jerry_acquire_value(it->second->callback);
+            jerry_value_t sample = jerry_call_function(callback, this_obj, NULL, 0);
+            jerry_release_value(callback);
+
+            uint8_t buffer[sizeof(it->second->last_value)];
+            size_t length;
+            if (!jerry_value_is_array(sample)) {
+                jerry_release_value(sample);
+                continue;
+            }
+
+            if (!js_array_to_buffer(sample, buffer, sizeof(buffer), &length)) {
+                LOG_PRINT_ALWAYS("sample exceeds %u bytes. Ignoring.\r\n", (unsigned)sizeof(buffer));
+                jerry_release_value(sample);
+                continue;
+            }
+            jerry_release_value(sample);
+
+            it = producers.find(characteristics[i]);
+            if (it == producers.end()) {
+                continue;
+            }
+            js_ble_producer_t* producer = it->second;
+
+            // the deadline already passed if the event this sample was
+            // produced for has started. Keep it for the repeat at the next
+            // event instead of writing it late.
+            bool late = (int32_t)(connection_event_count - producer_target_event) >= 0;
+
+            memcpy(producer->last_value, buffer, length);
+            producer->last_length = length;
+            producer->fresh = !late;
+
+            if (!late) {
+                ble.gattServer().write(it->first->getValueHandle(), producer->last_value, producer->last_length);
+            }
+        }
+    }
+
+    void repeatStaleValues() {
+        typedef map<GattCharacteristic*, js_ble_producer_t*>::iterator it_type;
+        for (it_type it = producers.begin(); it != producers.end(); it++) {
+            js_ble_producer_t* producer = it->second;
+
+            if (!producer->fresh && producer->last_length) {
+                ble.gattServer().write(it->first->getValueHandle(), producer->last_value, producer->last_length);
+            }
+
+            // start a new cycle
+            producer->fresh = false;
+        }
+    }
+
+#if BLE_ROLE_PERIPHERAL
+    virtual void onConnectionParametersUpdateComplete(const ble::ConnectionParametersUpdateCompleteEvent &event) {
+        if (event.getStatus() != BLE_ERROR_NONE) {
+            return;
+        }
+
+        // interval is in units of 1.25ms
+        connection_interval_us = event.getConnectionInterval().value() * 1250;
+        if (!producers.empty()) {
+            stopProducers();
+            startProducers();
+        }
+    }
+#endif
+
+    void onDataWrittenCallback(const GattWriteCallbackParams *params) {
+        // see if we know for which char this message is...
+        map<GattAttribute::Handle_t, GattCharacteristic*>::iterator char_it = characteristic_handles.find(params->handle);
+        if (char_it == characteristic_handles.end()) {
+            return;
+        }
+
+        map<GattCharacteristic*, jerry_value_t>::iterator it = write_callbacks.find(char_it->second);
+        if (it != write_callbacks.end() && jerry_value_is_function(it->second)) {
+            const jerry_value_t args[1] = {
+                getJsValueFromCharacteristic(it->first)
+            };
+
+            // @todo, this_obj is wrong
+            jerry_call_function(it->second, this_obj, args, 1);
+            jerry_release_value(args[0]);
         }
     }
 
@@ -233,6 +1080,31 @@ class BLEJS {
     jerry_value_t connect_cb_function;
     jerry_value_t disconnect_cb_function;
     map<GattCharacteristic*, jerry_value_t> write_callbacks;
+    vector<GattService*> services;
+    map<GattService*, jerry_value_t> service_objects;
+    map<GattAttribute::Handle_t, GattCharacteristic*> characteristic_handles;
+    service_changed_handler_t service_changed_handler;
+
+    BLEJSStore* store;
+    bool bonding_enabled;
+    Gap::Handle_t connection_handle;
+    char peer_key[16];
+    bool peer_secured;
+    map<GattAttribute::Handle_t, uint16_t> subscriptions;
+
+    map<GattCharacteristic*, js_ble_producer_t*> producers;
+    uint32_t connection_interval_us;
+    uint32_t producer_lead_us;
+    bool radio_notification_init;
+    bool radio_notification;
+    volatile uint32_t connection_event_count;
+    volatile uint32_t producer_target_event;
+    mbed::Timer event_timer;
+    mbed::Ticker connection_event_ticker;
+    mbed::Timeout producer_timeout;
+#if BLE_FEATURE_EXTENDED_ADVERTISING
+    map<ble::advertising_handle_t, js_ble_adv_set_data_t*> adv_sets;
+#endif
 
     BLE& ble;
 };
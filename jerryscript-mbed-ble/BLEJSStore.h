@@ -0,0 +1,95 @@
+/* Copyright (c) 2016 ARM Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _JERRYSCRIPT_MBED_BLE_BLEJSSTORE_H
+#define _JERRYSCRIPT_MBED_BLE_BLEJSSTORE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Key-value store used to persist per-peer state (CCCD subscriptions and
+ * the GATT database hash) across connections and resets.
+ *
+ * Implement this to back the state with whatever storage the target has,
+ * and hand it to BLEJS::setStore() before bonding is enabled.
+ */
+class BLEJSStore {
+ public:
+    virtual ~BLEJSStore() {}
+
+    // returns the number of bytes read, or -1 if the key does not exist
+    virtual int get(const char* key, uint8_t* buffer, size_t buffer_size) = 0;
+    virtual bool set(const char* key, const uint8_t* buffer, size_t length) = 0;
+    virtual void remove(const char* key) = 0;
+};
+
+/**
+ * Store keeping one file per key in an existing directory. Works on Linux
+ * for testing, and on mbed targets with a mounted FileSystem.
+ */
+class BLEJSFileStore : public BLEJSStore {
+ public:
+    BLEJSFileStore(const char* directory) {
+        strncpy(dir, directory, sizeof(dir) - 1);
+        dir[sizeof(dir) - 1] = '\0';
+    }
+
+    virtual int get(const char* key, uint8_t* buffer, size_t buffer_size) {
+        char path[96];
+        getPath(key, path, sizeof(path));
+
+        FILE* f = fopen(path, "rb");
+        if (!f) {
+            return -1;
+        }
+
+        size_t length = fread(buffer, 1, buffer_size, f);
+        fclose(f);
+
+        return (int)length;
+    }
+
+    virtual bool set(const char* key, const uint8_t* buffer, size_t length) {
+        char path[96];
+        getPath(key, path, sizeof(path));
+
+        FILE* f = fopen(path, "wb");
+        if (!f) {
+            return false;
+        }
+
+        bool ok = (fwrite(buffer, 1, length, f) == length);
+        fclose(f);
+
+        return ok;
+    }
+
+    virtual void remove(const char* key) {
+        char path[96];
+        getPath(key, path, sizeof(path));
+
+        ::remove(path);
+    }
+
+ private:
+    void getPath(const char* key, char* path, size_t path_size) {
+        snprintf(path, path_size, "%s/%s", dir, key);
+    }
+
+    char dir[64];
+};
+
+#endif // _JERRYSCRIPT_MBED_BLE_BLEJSSTORE_H
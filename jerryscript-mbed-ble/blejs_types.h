@@ -15,6 +15,8 @@
 #ifndef _JERRYSCRIPT_MBED_BLE_BLEJS_TYPES_H
 #define _JERRYSCRIPT_MBED_BLE_BLEJS_TYPES_H
 
+#include "jerryscript-mbed-library-registry/wrap_tools.h"
+
 #include "ble/BLE.h"
 
 typedef struct {
@@ -23,4 +25,24 @@ typedef struct {
     size_t characteristics_count;
 } js_ble_service_data_t;
 
+typedef struct {
+    // payloads are buffered natively, sized to the controller limit, so
+    // they can be updated (and re-applied on restart) without reallocating
+    uint8_t *payload;
+    size_t payload_length;
+    uint8_t *periodic_payload;
+    size_t periodic_payload_length;
+    size_t max_length;
+    bool connectable;
+} js_ble_adv_set_data_t;
+
+typedef struct {
+    jerry_value_t callback;
+    uint32_t lead_us;
+    // last sample, repeated when the callback misses an event
+    uint8_t last_value[23];
+    size_t last_length;
+    bool fresh;
+} js_ble_producer_t;
+
 #endif // _JERRYSCRIPT_MBED_BLE_BLEJS_TYPES_H
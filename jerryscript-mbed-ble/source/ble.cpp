@@ -22,6 +22,8 @@
 
 #include "Callback.h"
 
+#include <math.h>
+
 DECLARE_CLASS_FUNCTION(BLEDevice, startAdvertising) {
     CHECK_ARGUMENT_COUNT(BLEDevice, startAdvertising,
                         (args_count == 3 || args_count == 2 || args_count == 0));
@@ -51,6 +53,198 @@ DECLARE_CLASS_FUNCTION(BLEDevice, startAdvertising) {
     return jerry_create_undefined();
 }
 
+#if BLE_FEATURE_EXTENDED_ADVERTISING
+// checked before casting, as converting an out of range double is undefined
+static bool js_number_to_u32(jerry_value_t value, uint32_t max, uint32_t* out) {
+    double v = jerry_get_number_value(value);
+    if (!(v >= 0 && v <= max) || v != floor(v)) {
+        LOG_PRINT_ALWAYS("invalid argument, expected an integer from 0 to %lu. Ignoring.\r\n", (unsigned long)max);
+        return false;
+    }
+
+    *out = static_cast<uint32_t>(v);
+    return true;
+}
+
+static bool js_to_adv_handle(jerry_value_t value, ble::advertising_handle_t* handle) {
+    uint32_t v;
+    if (!js_number_to_u32(value, 0xFF, &v)) {
+        return false;
+    }
+
+    *handle = ble::advertising_handle_t(v);
+    return true;
+}
+
+DECLARE_CLASS_FUNCTION(BLEDevice, createAdvertisingSet) {
+    CHECK_ARGUMENT_COUNT(BLEDevice, createAdvertisingSet, (args_count == 1 || args_count == 2));
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, createAdvertisingSet, 0, number);
+    CHECK_ARGUMENT_TYPE_ON_CONDITION(BLEDevice, createAdvertisingSet, 1, boolean, args_count == 2);
+
+    uintptr_t native_handle;
+    jerry_get_object_native_handle(this_obj, &native_handle);
+
+    BLEJS *this_ble = (BLEJS*)native_handle;
+
+    uint32_t adv_interval;
+    if (!js_number_to_u32(args[0], 0xFFFFFFFF, &adv_interval)) {
+        return jerry_create_undefined();
+    }
+
+    bool connectable = (args_count == 2) && jerry_get_boolean_value(args[1]);
+
+    ble::advertising_handle_t handle;
+    if (!this_ble->createAdvertisingSet(adv_interval, connectable, &handle)) {
+        return jerry_create_undefined();
+    }
+
+    return jerry_create_number(double(handle));
+}
+
+DECLARE_CLASS_FUNCTION(BLEDevice, setAdvertisingPayload) {
+    CHECK_ARGUMENT_COUNT(BLEDevice, setAdvertisingPayload, (args_count == 2));
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, setAdvertisingPayload, 0, number);
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, setAdvertisingPayload, 1, array);
+
+    uintptr_t native_handle;
+    jerry_get_object_native_handle(this_obj, &native_handle);
+
+    BLEJS *this_ble = (BLEJS*)native_handle;
+
+    ble::advertising_handle_t handle;
+    if (!js_to_adv_handle(args[0], &handle)) {
+        return jerry_create_undefined();
+    }
+
+    this_ble->setAdvertisingPayload(handle, args[1]);
+
+    return jerry_create_undefined();
+}
+
+DECLARE_CLASS_FUNCTION(BLEDevice, startAdvertisingSet) {
+    CHECK_ARGUMENT_COUNT(BLEDevice, startAdvertisingSet, (args_count == 1));
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, startAdvertisingSet, 0, number);
+
+    uintptr_t native_handle;
+    jerry_get_object_native_handle(this_obj, &native_handle);
+
+    BLEJS *this_ble = (BLEJS*)native_handle;
+
+    ble::advertising_handle_t handle;
+    if (!js_to_adv_handle(args[0], &handle)) {
+        return jerry_create_undefined();
+    }
+
+    this_ble->startAdvertisingSet(handle);
+
+    return jerry_create_undefined();
+}
+
+DECLARE_CLASS_FUNCTION(BLEDevice, stopAdvertisingSet) {
+    CHECK_ARGUMENT_COUNT(BLEDevice, stopAdvertisingSet, (args_count == 1));
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, stopAdvertisingSet, 0, number);
+
+    uintptr_t native_handle;
+    jerry_get_object_native_handle(this_obj, &native_handle);
+
+    BLEJS *this_ble = (BLEJS*)native_handle;
+
+    ble::advertising_handle_t handle;
+    if (!js_to_adv_handle(args[0], &handle)) {
+        return jerry_create_undefined();
+    }
+
+    this_ble->stopAdvertisingSet(handle);
+
+    return jerry_create_undefined();
+}
+
+DECLARE_CLASS_FUNCTION(BLEDevice, destroyAdvertisingSet) {
+    CHECK_ARGUMENT_COUNT(BLEDevice, destroyAdvertisingSet, (args_count == 1));
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, destroyAdvertisingSet, 0, number);
+
+    uintptr_t native_handle;
+    jerry_get_object_native_handle(this_obj, &native_handle);
+
+    BLEJS *this_ble = (BLEJS*)native_handle;
+
+    ble::advertising_handle_t handle;
+    if (!js_to_adv_handle(args[0], &handle)) {
+        return jerry_create_undefined();
+    }
+
+    this_ble->destroyAdvertisingSet(handle);
+
+    return jerry_create_undefined();
+}
+
+#if BLE_FEATURE_PERIODIC_ADVERTISING
+DECLARE_CLASS_FUNCTION(BLEDevice, startPeriodicAdvertising) {
+    CHECK_ARGUMENT_COUNT(BLEDevice, startPeriodicAdvertising, (args_count == 2));
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, startPeriodicAdvertising, 0, number);
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, startPeriodicAdvertising, 1, number);
+
+    uintptr_t native_handle;
+    jerry_get_object_native_handle(this_obj, &native_handle);
+
+    BLEJS *this_ble = (BLEJS*)native_handle;
+
+    ble::advertising_handle_t handle;
+    if (!js_to_adv_handle(args[0], &handle)) {
+        return jerry_create_undefined();
+    }
+
+    uint32_t periodic_interval;
+    if (!js_number_to_u32(args[1], 0xFFFFFFFF, &periodic_interval)) {
+        return jerry_create_undefined();
+    }
+
+    this_ble->startPeriodicAdvertising(handle, periodic_interval);
+
+    return jerry_create_undefined();
+}
+
+DECLARE_CLASS_FUNCTION(BLEDevice, setPeriodicAdvertisingPayload) {
+    CHECK_ARGUMENT_COUNT(BLEDevice, setPeriodicAdvertisingPayload, (args_count == 2));
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, setPeriodicAdvertisingPayload, 0, number);
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, setPeriodicAdvertisingPayload, 1, array);
+
+    uintptr_t native_handle;
+    jerry_get_object_native_handle(this_obj, &native_handle);
+
+    BLEJS *this_ble = (BLEJS*)native_handle;
+
+    ble::advertising_handle_t handle;
+    if (!js_to_adv_handle(args[0], &handle)) {
+        return jerry_create_undefined();
+    }
+
+    this_ble->setPeriodicAdvertisingPayload(handle, args[1]);
+
+    return jerry_create_undefined();
+}
+
+DECLARE_CLASS_FUNCTION(BLEDevice, stopPeriodicAdvertising) {
+    CHECK_ARGUMENT_COUNT(BLEDevice, stopPeriodicAdvertising, (args_count == 1));
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, stopPeriodicAdvertising, 0, number);
+
+    uintptr_t native_handle;
+    jerry_get_object_native_handle(this_obj, &native_handle);
+
+    BLEJS *this_ble = (BLEJS*)native_handle;
+
+    ble::advertising_handle_t handle;
+    if (!js_to_adv_handle(args[0], &handle)) {
+        return jerry_create_undefined();
+    }
+
+    this_ble->stopPeriodicAdvertising(handle);
+
+    return jerry_create_undefined();
+}
+#endif // BLE_FEATURE_PERIODIC_ADVERTISING
+#endif // BLE_FEATURE_EXTENDED_ADVERTISING
+
 DECLARE_CLASS_FUNCTION(BLEDevice, isConnected) {
     CHECK_ARGUMENT_COUNT(BLEDevice, isConnected, (args_count == 0));
 
@@ -100,16 +294,19 @@ DECLARE_CLASS_FUNCTION(BLEDevice, addServices) {
 
     size_t service_count = jerry_get_array_length(args[0]);
     for (size_t i = 0; i < service_count; i++) {
-        // we'll hope and hope and hope that this is a Service :')
         jerry_value_t service = jerry_get_property_by_index(args[0], i);
 
         uintptr_t service_native_handle;
-        jerry_get_object_native_handle(service, &service_native_handle);
+        if (!jerry_value_is_object(service) || !jerry_get_object_native_handle(service, &service_native_handle)) {
+            LOG_PRINT_ALWAYS("addServices: element %u is not a Service. Ignoring.\r\n", (unsigned)i);
+            jerry_release_value(service);
+            continue;
+        }
 
         js_ble_service_data_t *service_data = (js_ble_service_data_t*)service_native_handle;
         GattService *service_ptr = service_data->service;
 
-        this_ble->addService(service_ptr);
+        this_ble->addService(service, service_ptr);
 
         jerry_release_value(service);
     }
@@ -117,6 +314,21 @@ DECLARE_CLASS_FUNCTION(BLEDevice, addServices) {
     return jerry_create_undefined();
 }
 
+#if BLE_FEATURE_SECURITY
+DECLARE_CLASS_FUNCTION(BLEDevice, enableBonding) {
+    CHECK_ARGUMENT_COUNT(BLEDevice, enableBonding, (args_count == 1));
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, enableBonding, 0, string);
+
+    uintptr_t native_handle;
+    jerry_get_object_native_handle(this_obj, &native_handle);
+
+    BLEJS *this_ble = (BLEJS*)native_handle;
+    this_ble->enableBonding(args[0]);
+
+    return jerry_create_undefined();
+}
+#endif // BLE_FEATURE_SECURITY
+
 DECLARE_CLASS_FUNCTION(BLEDevice, onConnection) {
     CHECK_ARGUMENT_COUNT(BLEDevice, ready, (args_count == 1));
     CHECK_ARGUMENT_TYPE_ALWAYS(BLEDevice, ready, 0, function);
@@ -167,6 +379,21 @@ DECLARE_CLASS_CONSTRUCTOR(BLEDevice) {
     ATTACH_CLASS_FUNCTION(js_object, BLEDevice, addServices);
     ATTACH_CLASS_FUNCTION(js_object, BLEDevice, ready);
     ATTACH_CLASS_FUNCTION(js_object, BLEDevice, isConnected);
+#if BLE_FEATURE_SECURITY
+    ATTACH_CLASS_FUNCTION(js_object, BLEDevice, enableBonding);
+#endif
+#if BLE_FEATURE_EXTENDED_ADVERTISING
+    ATTACH_CLASS_FUNCTION(js_object, BLEDevice, createAdvertisingSet);
+    ATTACH_CLASS_FUNCTION(js_object, BLEDevice, setAdvertisingPayload);
+    ATTACH_CLASS_FUNCTION(js_object, BLEDevice, startAdvertisingSet);
+    ATTACH_CLASS_FUNCTION(js_object, BLEDevice, stopAdvertisingSet);
+    ATTACH_CLASS_FUNCTION(js_object, BLEDevice, destroyAdvertisingSet);
+#if BLE_FEATURE_PERIODIC_ADVERTISING
+    ATTACH_CLASS_FUNCTION(js_object, BLEDevice, startPeriodicAdvertising);
+    ATTACH_CLASS_FUNCTION(js_object, BLEDevice, setPeriodicAdvertisingPayload);
+    ATTACH_CLASS_FUNCTION(js_object, BLEDevice, stopPeriodicAdvertising);
+#endif
+#endif
 
     return js_object;
 }
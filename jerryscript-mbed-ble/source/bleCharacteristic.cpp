@@ -25,7 +25,10 @@ void BLECharacteristic__destructor(uintptr_t native_ptr) {
     GattCharacteristic *data = (GattCharacteristic*)native_ptr;
 
     BLEJS::Instance().clearWriteCallback(data);
+    BLEJS::Instance().clearProducer(data);
 
+    // the value buffer is allocated by the constructor below
+    free(data->getValueAttribute().getValuePtr());
     delete data;
 }
 
@@ -87,6 +90,27 @@ DECLARE_CLASS_FUNCTION(BLECharacteristic, onUpdate) {
     return jerry_create_undefined();
 }
 
+DECLARE_CLASS_FUNCTION(BLECharacteristic, onBeforeConnectionEvent) {
+    CHECK_ARGUMENT_COUNT(BLECharacteristic, onBeforeConnectionEvent, (args_count == 2));
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLECharacteristic, onBeforeConnectionEvent, 0, number);
+    CHECK_ARGUMENT_TYPE_ALWAYS(BLECharacteristic, onBeforeConnectionEvent, 1, function);
+
+    uintptr_t native_handle;
+    jerry_get_object_native_handle(this_obj, &native_handle);
+
+    GattCharacteristic *native_ptr = (GattCharacteristic*)native_handle;
+
+    uint32_t lead_ms = static_cast<uint32_t>(jerry_get_number_value(args[0]));
+
+    jerry_value_t f = args[1];
+    jerry_acquire_value(f);
+
+    BLEJS* this_ble = &BLEJS::Instance();
+    this_ble->setProducer(native_ptr, lead_ms, f);
+
+    return jerry_create_undefined();
+}
+
 /**
  * GattCharacteristic:
  * - uuid
@@ -146,11 +170,12 @@ DECLARE_CLASS_CONSTRUCTOR(BLECharacteristic) {
 
     // create the jerryscript object
     jerry_value_t js_object = jerry_create_object();
-    jerry_set_object_native_handle(js_object, native_ptr, NULL);
+    jerry_set_object_native_handle(js_object, native_ptr, BLECharacteristic__destructor);
 
     ATTACH_CLASS_FUNCTION(js_object, BLECharacteristic, read);
     ATTACH_CLASS_FUNCTION(js_object, BLECharacteristic, write);
     ATTACH_CLASS_FUNCTION(js_object, BLECharacteristic, onUpdate);
+    ATTACH_CLASS_FUNCTION(js_object, BLECharacteristic, onBeforeConnectionEvent);
 
     return js_object;
 }
@@ -75,11 +75,16 @@ DECLARE_CLASS_CONSTRUCTOR(BLEService) {
 
     GattCharacteristic **characteristics_array = (GattCharacteristic**)calloc(characteristics_count, sizeof(GattCharacteristic*));
 
+    // the service references its characteristics, so keep their objects
+    // (which free them when collected) alive as long as the service
+    jerry_value_t char_objects = jerry_create_array(characteristics_count);
+
     for (uint32_t i = 0; i < characteristics_count; i++) {
         jerry_value_t char_obj = jerry_get_property_by_index(characteristics, i);
         uintptr_t native_ptr;
         jerry_get_object_native_handle(char_obj, &native_ptr);
         characteristics_array[i] = (GattCharacteristic*)native_ptr;
+        jerry_release_value(jerry_set_property_by_index(char_objects, i, char_obj));
         jerry_release_value(char_obj);
     }
 
@@ -96,6 +101,11 @@ DECLARE_CLASS_CONSTRUCTOR(BLEService) {
     jerry_value_t js_object = jerry_create_object();
     jerry_set_object_native_handle(js_object, native_ptr, BLEService__destructor);
 
+    jerry_value_t prop_name = jerry_create_string((const jerry_char_t *) "characteristics");
+    jerry_release_value(jerry_set_property(js_object, prop_name, char_objects));
+    jerry_release_value(prop_name);
+    jerry_release_value(char_objects);
+
     ATTACH_CLASS_FUNCTION(js_object, BLEService, getUUID);
 
     return js_object;